@@ -0,0 +1,5 @@
+# keymap.h builds its tables with c++14 constexpr; the standard only applies to c++ sources, so it goes in
+# CXXFLAGS rather than build_flags (which would also hand it to uart.c and the arduino core's c files)
+Import("env")
+
+env.Append(CXXFLAGS=["-std=gnu++14"])
@@ -0,0 +1,149 @@
+#ifndef AMIGAHID_DOT_H
+#define AMIGAHID_DOT_H
+
+#include <hidcomposite.h>
+
+#include "keymap.h"
+
+// old keyboard hid buffer size
+#define HID_BUF_MAX     32
+
+// most usages held at once in a consumer/system control report (further usages are ignored)
+#define USAGES_MAX      4
+
+// most non-boot interfaces looked at on one device (others are rejected in SelectInterface)
+#define NONBOOT_IFACES_MAX \
+                        3
+
+// most consumer/system control reports learned from one device's report descriptors
+#define ROUTES_MAX      4
+
+// most mapped usages followed in one bitmap field (bits for usages without a mapping aren't kept)
+#define ROUTE_BITS_MAX  8
+
+// how a routed report lays out its usages
+#define ROUTE_ARRAY8    0 // array of 8-bit values
+#define ROUTE_ARRAY16   1 // array of 16-bit little endian values
+#define ROUTE_BITMAP    2 // one bit per usage, listed in bits[]
+
+/**
+ * walks the report descriptor of a non-boot interface looking for top-level consumer control and system
+ * control collections, and records which report id carries each and how its usages are laid out. the usb host
+ * shield library hands the descriptor over in chunks, so the scanner keeps its place byte by byte. anything
+ * it doesn't recognise gets no route, and ParseHIDData drops reports without one.
+ */
+class ReportRouteScanner : public USBReadParser
+{
+    public:
+        struct Route
+        {
+            uint8_t ep;
+            uint8_t report_id;      // 0 if the interface doesn't use report ids
+            uint16_t usage_page;
+            uint8_t format;         // ROUTE_*
+            uint8_t count;          // array: number of slots; bitmap: entries used in bits[]
+            uint16_t offset;        // array: bit offset of the first slot, after any report id byte
+            uint16_t usage_min;
+            uint16_t logical_min;   // array values are indexes from here into the usages from usage_min
+
+            // bitmap: bit offset (after any report id byte) of each mapped usage
+            struct {
+                uint16_t bit;
+                uint16_t usage;
+            } bits[ROUTE_BITS_MAX];
+
+            uint16_t held[USAGES_MAX]; // usages down in the last report on this route
+        };
+
+        ReportRouteScanner() : num_routes(0) {};
+        void Begin(uint8_t ep);
+        void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset);
+        Route *Find(uint8_t ep, uint8_t report_id);
+        bool Routed(uint8_t ep) const;
+        uint8_t Count() const { return num_routes; };
+        Route *Get(uint8_t i) { return &routes[i]; };
+        void Clear() { num_routes = 0; };
+
+    private:
+        Route routes[ROUTES_MAX];
+        uint8_t num_routes;
+
+        // item currently being read
+        uint8_t prefix, pending, received, skip;
+        uint16_t value;
+
+        // descriptor state at this point
+        uint8_t ep, depth, report_id, report_size, report_count;
+        uint16_t usage_page, usage, usage_min, usage_max, logical_min;
+        uint16_t collection_page, collection_usage;
+        uint16_t bit_offset;        // where the next input field of this report id starts
+
+        // local usages for the next main item: how many Usage items, and which of them have a mapping
+        uint8_t num_usages, num_mapped;
+        bool have_usage_min, have_usage_max;
+        struct {
+            uint8_t index;
+            uint16_t usage;
+        } mapped[ROUTE_BITS_MAX];
+
+        void Item(uint8_t tag, uint16_t data);
+        void AddRoute(uint8_t format, uint16_t field);
+        void AddBit(Route *route, uint16_t bit, uint16_t usage);
+};
+
+// extend HIDComposite, replace SelectInterface & ParseHIDData to select & process keyboards
+class AmigaHID : public HIDComposite
+{
+    uint8_t old_buf_len;
+    uint8_t *old_buf;
+    bool caps_lock;
+
+    // non-boot interfaces and their interrupt in endpoint; reports from these never reach ParseKeyboard
+    struct {
+        uint8_t iface;
+        uint8_t ep;
+    } nonboot[NONBOOT_IFACES_MAX];
+    uint8_t num_nonboot;
+    ReportRouteScanner routes;
+
+    public:
+        AmigaHID(USB *p) : HIDComposite(p), num_nonboot(0) {};
+        void Setup(USB *p);
+        void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *pep);
+        uint8_t Release();
+
+    protected:
+        void ParseHIDData(USBHID *hid, uint8_t ep, bool is_rpt_id, uint8_t len, uint8_t *buf);
+        bool SelectInterface(uint8_t iface, uint8_t proto);
+        uint8_t OnInitSuccessful();
+
+    private:
+        void DebugPrint(const char *fmt, ...);
+        void SendAmiga(uint8_t keycode);
+
+        // hid usage to amiga keycode for keyboard reports; inline so the hot path stays a single table index
+        uint8_t TranslateKey(uint8_t usage) { return mapHidToAmiga[usage]; };
+
+        void ParseKeyboard(USBHID *hid, uint8_t len, uint8_t *buf);
+        void ParseUsages(ReportRouteScanner::Route *route, uint8_t len, uint8_t *buf);
+        void SendUsage(uint16_t page, uint16_t usage, bool down);
+        bool KeyInBuffer(uint8_t code, uint8_t len, uint8_t *buf);
+        void InitiateAmigaReset();
+        void EndAmigaReset();
+        bool TrinityCheck(uint8_t len, uint8_t *buf);
+
+#ifdef PIO_UNIT_TESTING
+        // the hot path tests under test/ need to poke state and call private methods
+        friend class HotPathProbe;
+
+        // when set, SendAmiga notes keycodes here instead of clocking them out, so parsers can be timed alone
+        uint8_t *send_log;
+        uint8_t send_log_max;
+        uint8_t send_count;
+
+        // likewise, when set, the caps lock led byte is noted here instead of going to the keyboard
+        uint8_t *led_log;
+#endif
+};
+
+#endif
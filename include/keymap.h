@@ -0,0 +1,426 @@
+#ifndef KEYMAP_DOT_H
+#define KEYMAP_DOT_H
+
+/**
+ * keymaps are written as a list of (hid usage, amiga keycode) pairs and expanded at compile time into the
+ * dense tables the firmware indexes at runtime. the expansion is constexpr, so the result is exactly the same
+ * 256 byte array we always had (one index per key, no searching), but nobody has to count columns any more
+ * to work out which slot 0x65 is. static_asserts at the bottom catch duplicates and missing keys before the
+ * firmware is ever flashed. the tables are defined once, in keymap.cpp.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+// amiga keycodes (transcribed from amiga developer cd 2.1)
+#define AMIGA_BACKTICK  0x00 // backtick / shifted tilde
+#define AMIGA_ONE       0x01 // 1 / shifted exclaim
+#define AMIGA_TWO       0x02 // 2 / shifted at
+#define AMIGA_THREE     0x03 // 3 / shifted hash
+#define AMIGA_FOUR      0x04 // 4 / shifted dollar
+#define AMIGA_FIVE      0x05 // 5 / shifted percent
+#define AMIGA_SIX       0x06 // 6 / shifted caret
+#define AMIGA_SEVEN     0x07 // 7 / shifted ampersand
+#define AMIGA_EIGHT     0x08 // 8 / shifted asterisk
+#define AMIGA_NINE      0x09 // 9 / shifted open parens
+#define AMIGA_ZERO      0x0a // 0 / shifted close parens
+#define AMIGA_DASH      0x0b // dash / shifted underscore
+#define AMIGA_EQUALS    0x0c // equals / shifted plus
+#define AMIGA_BACKSLASH 0x0d // backslash / shifted pipe
+#define AMIGA_SPARE1    0x0e
+#define AMIGA_KPZERO    0x0f
+#define AMIGA_Q         0x10
+#define AMIGA_W         0x11
+#define AMIGA_E         0x12
+#define AMIGA_R         0x13
+#define AMIGA_T         0x14
+#define AMIGA_Y         0x15
+#define AMIGA_U         0x16
+#define AMIGA_I         0x17
+#define AMIGA_O         0x18
+#define AMIGA_P         0x19
+#define AMIGA_OSQPARENS 0x1a // open square parens / shifted open curly parens
+#define AMIGA_CSQPARENS 0x1b // close square parents / shifted close curly parens
+#define AMIGA_SPARE2    0x1c
+#define AMIGA_KPONE     0x1d
+#define AMIGA_KPTWO     0x1e
+#define AMIGA_KPTHREE   0x1f
+#define AMIGA_A         0x20
+#define AMIGA_S         0x21
+#define AMIGA_D         0x22
+#define AMIGA_F         0x23
+#define AMIGA_G         0x24
+#define AMIGA_H         0x25
+#define AMIGA_J         0x26
+#define AMIGA_K         0x27
+#define AMIGA_L         0x28
+#define AMIGA_SEMICOLON 0x29 // semicolon / shifted colon
+#define AMIGA_QUOTE     0x2a // quote / shifted doublequote
+#define AMIGA_INTLRET   0x2b // international only, return
+#define AMIGA_SPARE3    0x2c
+#define AMIGA_KPFOUR    0x2d
+#define AMIGA_KPFIVE    0x2e
+#define AMIGA_KPSIX     0x2f
+#define AMIGA_INTLSHIFT 0x30 // international only, left shift
+#define AMIGA_Z         0x31
+#define AMIGA_X         0x32
+#define AMIGA_C         0x33
+#define AMIGA_V         0x34
+#define AMIGA_B         0x35
+#define AMIGA_N         0x36
+#define AMIGA_M         0x37
+#define AMIGA_COMMA     0x38 // comma / shifted less than
+#define AMIGA_PERIOD    0x39 // period / shifted greater than
+#define AMIGA_SLASH     0x3a // slash / shifted question mark
+#define AMIGA_SPARE7    0x3b
+#define AMIGA_KPPERIOD  0x3c
+#define AMIGA_KPSEVEN   0x3d
+#define AMIGA_KPEIGHT   0x3e
+#define AMIGA_KPNINE    0x3f
+#define AMIGA_SPACE     0x40
+#define AMIGA_BACKSP    0x41
+#define AMIGA_TAB       0x42
+#define AMIGA_KPENTER   0x43
+#define AMIGA_RETURN    0x44
+#define AMIGA_ESC       0x45
+#define AMIGA_DELETE    0x46
+#define AMIGA_SPARE4    0x47
+#define AMIGA_SPARE5    0x48
+#define AMIGA_SPARE6    0x49
+#define AMIGA_KPDASH    0x4a
+// 0x4b absent
+#define AMIGA_UP        0x4c
+#define AMIGA_DOWN      0x4d
+#define AMIGA_RIGHT     0x4e
+#define AMIGA_LEFT      0x4f
+#define AMIGA_F1        0x50
+#define AMIGA_F2        0x51
+#define AMIGA_F3        0x52
+#define AMIGA_F4        0x53
+#define AMIGA_F5        0x54
+#define AMIGA_F6        0x55
+#define AMIGA_F7        0x56
+#define AMIGA_F8        0x57
+#define AMIGA_F9        0x58
+#define AMIGA_F10       0x59
+#define AMIGA_KPOPAREN  0x5a // open bracket
+#define AMIGA_KPCPAREN  0x5b
+#define AMIGA_KPSLASH   0x5c
+#define AMIGA_KPAST     0x5d // asterisk abbreviated
+#define AMIGA_KPPLUS    0x5e
+#define AMIGA_HELP      0x5f
+#define AMIGA_LSHIFT    0x60 // modifier
+#define AMIGA_RSHIFT    0x61 // modifier
+#define AMIGA_CAPSLOCK  0x62 // modifier
+#define AMIGA_CTRL      0x63 // modifier
+#define AMIGA_LALT      0x64 // modifier
+#define AMIGA_RALT      0x65 // modifier
+#define AMIGA_LAMIGA    0x66 // modifier
+#define AMIGA_RAMIGA    0x67 // modifier
+// 0x68 - 0x7f absent (except 0x78)
+#define AMIGA_RESET     0x78
+#define AMIGA_INITPOWER 0xfd
+#define AMIGA_TERMPOWER 0xfe
+#define AMIGA_UNKNOWN   0xff
+
+// hid usage 0x00 is "no event"; used as the empty slot in the amiga to hid table
+#define HID_NONE        0x00
+
+// amiga raw keycodes are 7-bit; bit 7 is the key up flag
+#define AMIGA_CODE_MAX  0x80
+
+// one (hid usage, amiga keycode) pair in a layout
+struct KeyMapping
+{
+    uint8_t hid;
+    uint8_t amiga;
+};
+
+/**
+ * dense lookup table of SIZE entries, indexed directly by the code being translated. the index is masked to
+ * the table size, which costs nothing for the 256 entry table and means an amiga key up code (bit 7 set)
+ * looks up the same key as its key down in the 128 entry one, rather than reading off the end.
+ */
+template <size_t SIZE>
+struct KeyTable
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "KeyTable size must be a power of two");
+
+    uint8_t code[SIZE];
+
+    constexpr uint8_t operator[](uint8_t index) const { return code[index & (SIZE - 1)]; }
+};
+
+// expand a layout into the hid usage -> amiga keycode table used on the hot path
+template <size_t N>
+constexpr KeyTable<256> BuildHidToAmiga(const KeyMapping (&layout)[N])
+{
+    KeyTable<256> table = {};
+
+    for (size_t i = 0; i < 256; i++)
+        table.code[i] = AMIGA_UNKNOWN;
+    for (size_t i = 0; i < N; i++)
+        table.code[layout[i].hid] = layout[i].amiga;
+
+    return table;
+}
+
+// expand a layout into the amiga keycode -> hid usage table (for tests and diagnostics, not the hot path)
+template <size_t N>
+constexpr KeyTable<AMIGA_CODE_MAX> BuildAmigaToHid(const KeyMapping (&layout)[N])
+{
+    KeyTable<AMIGA_CODE_MAX> table = {};
+
+    for (size_t i = 0; i < AMIGA_CODE_MAX; i++)
+        table.code[i] = HID_NONE;
+    for (size_t i = 0; i < N; i++)
+        if (layout[i].amiga < AMIGA_CODE_MAX)
+            table.code[layout[i].amiga] = layout[i].hid;
+
+    return table;
+}
+
+// every pair must map a real hid usage to a real (7-bit, key down) amiga keycode
+template <size_t N>
+constexpr bool LayoutCodesValid(const KeyMapping (&layout)[N])
+{
+    for (size_t i = 0; i < N; i++)
+        if ((layout[i].hid == HID_NONE) || (layout[i].amiga >= AMIGA_CODE_MAX))
+            return false;
+
+    return true;
+}
+
+// no hid usage may appear twice (the later one would silently win)
+template <size_t N>
+constexpr bool LayoutHidUnique(const KeyMapping (&layout)[N])
+{
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = i + 1; j < N; j++)
+            if (layout[i].hid == layout[j].hid)
+                return false;
+
+    return true;
+}
+
+// no amiga keycode may appear twice, otherwise the inverse table can't be built
+template <size_t N>
+constexpr bool LayoutAmigaUnique(const KeyMapping (&layout)[N])
+{
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = i + 1; j < N; j++)
+            if (layout[i].amiga == layout[j].amiga)
+                return false;
+
+    return true;
+}
+
+/**
+ * amiga keycodes a layout is not expected to cover: the spare/international keys which pc keyboards lack, the
+ * keypad parentheses, and the modifiers, which arrive in the hid modifier byte and are handled in ParseHIDData
+ * rather than through the table. right amiga is deliberately absent from this list; it lives on menu (0x65).
+ */
+static constexpr uint8_t amigaUnmappedCodes[] = {
+    AMIGA_SPARE1, AMIGA_SPARE2, AMIGA_INTLRET, AMIGA_SPARE3, AMIGA_INTLSHIFT, AMIGA_SPARE7, AMIGA_SPARE4,
+    AMIGA_SPARE5, AMIGA_SPARE6, 0x4b, AMIGA_KPOPAREN, AMIGA_KPCPAREN, AMIGA_LSHIFT, AMIGA_RSHIFT, AMIGA_CTRL,
+    AMIGA_LALT, AMIGA_RALT, AMIGA_LAMIGA
+};
+
+// every amiga key from backtick to right amiga must be reachable, bar those listed above
+template <size_t N>
+constexpr bool LayoutCoversAmiga(const KeyMapping (&layout)[N])
+{
+    for (uint8_t code = AMIGA_BACKTICK; code <= AMIGA_RAMIGA; code++) {
+        bool exempt = false, found = false;
+
+        for (size_t i = 0; i < sizeof(amigaUnmappedCodes); i++)
+            if (amigaUnmappedCodes[i] == code)
+                exempt = true;
+        for (size_t i = 0; i < N; i++)
+            if (layout[i].amiga == code)
+                found = true;
+
+        if (!exempt && !found)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * this layout is very US-centric right now, which may not be a bad thing, but @todo check for non-US maps
+ * interesting how hid keyboards are alphabetical, amiga are qwerty layout. actually not interesting at all.
+ * keep it sorted by hid usage (usb hid usage tables, keyboard/keypad page 0x07).
+ */
+static constexpr KeyMapping layoutUS[] = {
+    { 0x04, AMIGA_A },          { 0x05, AMIGA_B },          { 0x06, AMIGA_C },          { 0x07, AMIGA_D },
+    { 0x08, AMIGA_E },          { 0x09, AMIGA_F },          { 0x0a, AMIGA_G },          { 0x0b, AMIGA_H },
+    { 0x0c, AMIGA_I },          { 0x0d, AMIGA_J },          { 0x0e, AMIGA_K },          { 0x0f, AMIGA_L },
+    { 0x10, AMIGA_M },          { 0x11, AMIGA_N },          { 0x12, AMIGA_O },          { 0x13, AMIGA_P },
+    { 0x14, AMIGA_Q },          { 0x15, AMIGA_R },          { 0x16, AMIGA_S },          { 0x17, AMIGA_T },
+    { 0x18, AMIGA_U },          { 0x19, AMIGA_V },          { 0x1a, AMIGA_W },          { 0x1b, AMIGA_X },
+    { 0x1c, AMIGA_Y },          { 0x1d, AMIGA_Z },
+    { 0x1e, AMIGA_ONE },        { 0x1f, AMIGA_TWO },        { 0x20, AMIGA_THREE },      { 0x21, AMIGA_FOUR },
+    { 0x22, AMIGA_FIVE },       { 0x23, AMIGA_SIX },        { 0x24, AMIGA_SEVEN },      { 0x25, AMIGA_EIGHT },
+    { 0x26, AMIGA_NINE },       { 0x27, AMIGA_ZERO },
+    { 0x28, AMIGA_RETURN },     // enter
+    { 0x29, AMIGA_ESC },
+    { 0x2a, AMIGA_BACKSP },
+    { 0x2b, AMIGA_TAB },
+    { 0x2c, AMIGA_SPACE },
+    { 0x2d, AMIGA_DASH },
+    { 0x2e, AMIGA_EQUALS },
+    { 0x2f, AMIGA_OSQPARENS },
+    { 0x30, AMIGA_CSQPARENS },
+    { 0x31, AMIGA_BACKSLASH },
+    // 0x32 non-us hash unmapped
+    { 0x33, AMIGA_SEMICOLON },
+    { 0x34, AMIGA_QUOTE },
+    { 0x35, AMIGA_BACKTICK },   // grave accent / tilde
+    { 0x36, AMIGA_COMMA },
+    { 0x37, AMIGA_PERIOD },
+    { 0x38, AMIGA_SLASH },
+    { 0x39, AMIGA_CAPSLOCK },
+    { 0x3a, AMIGA_F1 },         { 0x3b, AMIGA_F2 },         { 0x3c, AMIGA_F3 },         { 0x3d, AMIGA_F4 },
+    { 0x3e, AMIGA_F5 },         { 0x3f, AMIGA_F6 },         { 0x40, AMIGA_F7 },         { 0x41, AMIGA_F8 },
+    { 0x42, AMIGA_F9 },         { 0x43, AMIGA_F10 },
+    // 0x44 - 0x48 (f11, f12, print screen, scroll lock, pause) unmapped
+    { 0x49, AMIGA_HELP },       // insert
+    // 0x4a - 0x4b (home, page up) unmapped
+    { 0x4c, AMIGA_DELETE },     // delete forward
+    // 0x4d - 0x4e (end, page down) unmapped
+    { 0x4f, AMIGA_RIGHT },
+    { 0x50, AMIGA_LEFT },
+    { 0x51, AMIGA_DOWN },
+    { 0x52, AMIGA_UP },
+    // 0x53 num lock unmapped
+    { 0x54, AMIGA_KPSLASH },
+    { 0x55, AMIGA_KPAST },
+    { 0x56, AMIGA_KPDASH },
+    { 0x57, AMIGA_KPPLUS },
+    { 0x58, AMIGA_KPENTER },
+    { 0x59, AMIGA_KPONE },      { 0x5a, AMIGA_KPTWO },      { 0x5b, AMIGA_KPTHREE },    { 0x5c, AMIGA_KPFOUR },
+    { 0x5d, AMIGA_KPFIVE },     { 0x5e, AMIGA_KPSIX },      { 0x5f, AMIGA_KPSEVEN },    { 0x60, AMIGA_KPEIGHT },
+    { 0x61, AMIGA_KPNINE },     { 0x62, AMIGA_KPZERO },
+    { 0x63, AMIGA_KPPERIOD },
+    // 0x64 non-us backslash unmapped
+    { 0x65, AMIGA_RAMIGA },     // application (menu); see HID_MENU_CODE
+};
+
+static_assert(LayoutCodesValid(layoutUS), "layoutUS: hid usage 0x00 or amiga keycode out of range");
+static_assert(LayoutHidUnique(layoutUS), "layoutUS: hid usage mapped more than once");
+static_assert(LayoutAmigaUnique(layoutUS), "layoutUS: amiga keycode mapped more than once");
+static_assert(LayoutCoversAmiga(layoutUS), "layoutUS: amiga keycode missing from layout");
+
+// the tables themselves, built from layoutUS in keymap.cpp so the whole program shares one copy of each
+extern const KeyTable<256> mapHidToAmiga;
+extern const KeyTable<AMIGA_CODE_MAX> mapAmigaToHid;
+
+/**
+ * the generated tables must be exact inverses of each other and of the layout: every layout pair is found
+ * in both directions, every mapped hid usage comes back to itself through the amiga table, and every mapped
+ * amiga keycode comes back to itself through the hid table
+ */
+template <size_t N>
+constexpr bool TablesRoundTrip(const KeyMapping (&layout)[N], const KeyTable<256> &to_amiga,
+                               const KeyTable<AMIGA_CODE_MAX> &to_hid)
+{
+    for (size_t i = 0; i < N; i++)
+        if ((to_amiga[layout[i].hid] != layout[i].amiga) || (to_hid[layout[i].amiga] != layout[i].hid))
+            return false;
+
+    for (size_t hid = 0; hid < 256; hid++)
+        if ((to_amiga[hid] != AMIGA_UNKNOWN) && (to_hid[to_amiga[hid]] != hid))
+            return false;
+
+    for (size_t code = 0; code < AMIGA_CODE_MAX; code++)
+        if ((to_hid[code] != HID_NONE) && (to_amiga[to_hid[code]] != code))
+            return false;
+
+    return true;
+}
+
+static_assert(TablesRoundTrip(layoutUS, BuildHidToAmiga(layoutUS), BuildAmigaToHid(layoutUS)),
+              "layoutUS: hid and amiga tables don't round trip");
+
+// hid usage pages we know what to do with
+#define USAGE_PAGE_GENERIC_DESKTOP \
+                        0x01 // system control (power, sleep, wake)
+#define USAGE_PAGE_CONSUMER \
+                        0x0c // multimedia keys
+
+// longest amiga key sequence a single usage may send (pad unused slots with AMIGA_UNKNOWN)
+#define USAGE_MACRO_MAX 3
+
+/**
+ * consumer and system control usages don't exist on the amiga, so they map to either one amiga key or a short
+ * macro: the keys go down in order and come up in reverse, so { AMIGA_LAMIGA, AMIGA_N } behaves like holding
+ * left amiga and tapping n.
+ */
+struct UsageMapping
+{
+    uint16_t page;
+    uint16_t usage;
+    uint8_t amiga[USAGE_MACRO_MAX];
+};
+
+// find the mapping for a usage; NULL if the usage isn't mapped (short table, so a linear walk will do)
+template <size_t N>
+constexpr const UsageMapping *FindUsageMapping(const UsageMapping (&map)[N], uint16_t page, uint16_t usage)
+{
+    for (size_t i = 0; i < N; i++)
+        if ((map[i].page == page) && (map[i].usage == usage))
+            return &map[i];
+
+    return NULL;
+}
+
+// each macro must start with a real key and only be padded with AMIGA_UNKNOWN at the end
+template <size_t N>
+constexpr bool UsageMapValid(const UsageMapping (&map)[N])
+{
+    for (size_t i = 0; i < N; i++) {
+        if (map[i].amiga[0] >= AMIGA_CODE_MAX)
+            return false;
+
+        for (size_t j = 1; j < USAGE_MACRO_MAX; j++) {
+            if ((map[i].amiga[j] >= AMIGA_CODE_MAX) && (map[i].amiga[j] != AMIGA_UNKNOWN))
+                return false;
+            if ((map[i].amiga[j] < AMIGA_CODE_MAX) && (map[i].amiga[j - 1] == AMIGA_UNKNOWN))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// no (page, usage) may appear twice
+template <size_t N>
+constexpr bool UsageMapUnique(const UsageMapping (&map)[N])
+{
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = i + 1; j < N; j++)
+            if ((map[i].page == map[j].page) && (map[i].usage == map[j].usage))
+                return false;
+
+    return true;
+}
+
+/**
+ * multimedia and system key mappings. there's not much on an amiga a volume knob can do, so these are
+ * workbench shortcuts; add your own (usb hid usage tables: consumer is page 0x0c, system control is 0x81-0x83
+ * on page 0x01). system power down is left unmapped on purpose: reset stays on ctrl-amiga-amiga, and a
+ * stray brush of the power key shouldn't do anything to the amiga.
+ */
+static constexpr UsageMapping usageMapUS[] = {
+    { USAGE_PAGE_CONSUMER, 0x0040, { AMIGA_HELP,   AMIGA_UNKNOWN, AMIGA_UNKNOWN } }, // menu
+    { USAGE_PAGE_CONSUMER, 0x0223, { AMIGA_LAMIGA, AMIGA_N,       AMIGA_UNKNOWN } }, // ac home: workbench to front
+    { USAGE_PAGE_CONSUMER, 0x0224, { AMIGA_LAMIGA, AMIGA_M,       AMIGA_UNKNOWN } }, // ac back: front screen to back
+    { USAGE_PAGE_GENERIC_DESKTOP, 0x0082, { AMIGA_LAMIGA, AMIGA_M, AMIGA_UNKNOWN } }, // system sleep: front screen to back
+    { USAGE_PAGE_GENERIC_DESKTOP, 0x0083, { AMIGA_LAMIGA, AMIGA_N, AMIGA_UNKNOWN } }, // system wake up: workbench to front
+};
+
+static_assert(UsageMapValid(usageMapUS), "usageMapUS: macro has bad keycode or gap");
+static_assert(UsageMapUnique(usageMapUS), "usageMapUS: usage mapped more than once");
+
+#endif
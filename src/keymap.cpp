@@ -0,0 +1,8 @@
+/**
+ * keymap tables for the runtime, expanded at compile time from the layout in keymap.h.
+ */
+
+#include "keymap.h"
+
+const KeyTable<256> mapHidToAmiga = BuildHidToAmiga(layoutUS);
+const KeyTable<AMIGA_CODE_MAX> mapAmigaToHid = BuildAmigaToHid(layoutUS);
@@ -0,0 +1,44 @@
+#ifndef BUDGETS_DOT_H
+#define BUDGETS_DOT_H
+
+/**
+ * cycle and stack budgets for the hot paths, checked by test_main.cpp under simavr (atmega2560 @ 16MHz).
+ * the numbers are ceilings, not targets: anything that pushes a path over its budget fails the suite.
+ * if a change legitimately costs more, raise the budget in the same commit and say why.
+ *
+ * the parser budgets cover the parser alone: SendAmiga is stubbed to a log while they run, so a slower parser
+ * can't hide in the 91520 cycles of bus timing each key costs. SendAmiga's own budget is that bus timing
+ * (8 bits of 20+20+50us plus the 5ms handshake wait) and about 1.5% for the code around it.
+ *
+ * PROVISIONAL: apart from SendAmiga these have not been measured yet; they're estimates from reading the
+ * code, pitched high. the suite is deliberately not in ci until they are. to settle them, run
+ * `pio test -e simavr`, set each budget to the printed value plus 10% (rounded up to a tidy number), list the
+ * measured values in the commit message, drop this paragraph and add the test step to .travis.yml.
+ */
+
+// cycles (timer overhead already subtracted)
+#define BUDGET_CYCLES_ISR               64          // TIMER1_COMPA_vect, including call and reti
+#define BUDGET_CYCLES_KEYMAP            150         // TranslateKey over the six key slots of a boot report
+#define BUDGET_CYCLES_SENDAMIGA         93000       // one keycode out on kbclock/kbdata
+#define BUDGET_CYCLES_PARSE_IDLE        1500        // repeated report, key held, nothing sent
+#define BUDGET_CYCLES_PARSE_KEYDOWN     1600        // one key down from an empty report
+#define BUDGET_CYCLES_PARSE_KEYDOWN_NONBOOT \
+                                        1650        // the same, with a non-boot interface attached
+#define BUDGET_CYCLES_PARSE_CAPSLOCK    1800        // caps lock down from an empty report, led byte logged not sent
+#define BUDGET_CYCLES_PARSE_WORST       3000        // all modifiers down and six keys swapped for six others (18 sends)
+#define BUDGET_CYCLES_PARSE_CONSUMER    1500        // consumer report on a routed interface, two key macro down
+
+// stack bytes used below the caller's stack pointer (includes any timer interrupt that lands mid-path)
+#define BUDGET_STACK_ISR                24
+#define BUDGET_STACK_KEYMAP             16
+#define BUDGET_STACK_SENDAMIGA          48
+#define BUDGET_STACK_PARSE              96
+
+/**
+ * total sram in use at the deepest point reached by any hot path (.data + .bss + heap + stack). this is the
+ * test image, not the firmware: unity, arduino's Serial and the test's own buffers are in it, the hub and
+ * uart stdio of the firmware aren't. read it as a bound on the hot paths, not on the firmware as shipped.
+ */
+#define BUDGET_SRAM_HIGH_WATER          4096
+
+#endif
@@ -0,0 +1,353 @@
+/**
+ * cycle and stack budget checks for the firmware hot paths, run on a simulated atmega2560 under simavr:
+ *
+ *   pio test -e simavr
+ *
+ * cycles are counted with TIMER5 at prescaler 1 (TIMER1 belongs to the firmware), with a small overflow
+ * isr extending it to 32 bits. stack use is measured by painting the free sram below the stack pointer before
+ * each run and finding the lowest byte that got scribbled on afterwards. budgets live in budgets.h.
+ *
+ * the parser tests log what SendAmiga would have sent rather than clocking it out, so their cycle counts are
+ * the parser's own, and they check that the right keycodes came out. SendAmiga is timed on its own.
+ */
+
+#include <Arduino.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "keymap.h"
+#include "amigahid.h"
+#include "budgets.h"
+
+// the firmware's sync isr; called directly so it can be timed
+extern "C" void TIMER1_COMPA_vect(void);
+
+// start of the heap, and how far malloc has taken it (avr-libc)
+extern char __heap_start;
+extern char *__brkval;
+
+// value painted over free sram; anything else found there afterwards was written by the path under test
+#define STACK_PAINT     0xc5
+
+struct Measurement
+{
+    uint32_t cycles;
+    uint16_t stack;
+};
+
+// keycodes the parser under test sent, in order
+static uint8_t sent[24];
+static uint8_t leds;
+
+static volatile uint16_t timer_overflows;
+static uint32_t cycles_overhead;
+static uint8_t *sram_lowest = (uint8_t *)RAMEND;
+
+USB         Usb;
+AmigaHID    amigaHid(&Usb);
+
+// extend the 16-bit cycle counter
+ISR(TIMER5_OVF_vect)
+{
+    timer_overflows++;
+}
+
+// lowest address the stack can grow down to
+static inline uint8_t *StackBottom()
+{
+    return (uint8_t *)(__brkval ? __brkval : &__heap_start);
+}
+
+/**
+ * run CALL with the cycle counter going and the stack painted. this is a macro rather than a function so that
+ * nothing other than CALL itself touches sram below the stack pointer captured at the start. TIMER0 (millis)
+ * is held off for the duration so it doesn't land in the count; TIMER5's own overflow isr is counted.
+ */
+#define MEASURE(RESULT, CALL) \
+    do { \
+        uint8_t *sp_, *p_, timsk0_; \
+        Serial.flush(); \
+        timsk0_ = TIMSK0; \
+        TIMSK0 = 0; \
+        sp_ = (uint8_t *)SP; \
+        for (p_ = StackBottom(); p_ < sp_; p_++) \
+            *p_ = STACK_PAINT; \
+        timer_overflows = 0; \
+        TCNT5 = 0; \
+        TIFR5 = _BV(TOV5); \
+        TCCR5B = _BV(CS50); \
+        CALL; \
+        TCCR5B = 0; \
+        cli(); \
+        if (TIFR5 & _BV(TOV5)) { \
+            timer_overflows++; \
+            TIFR5 = _BV(TOV5); \
+        } \
+        (RESULT).cycles = ((uint32_t)timer_overflows << 16) | TCNT5; \
+        sei(); \
+        TIMSK0 = timsk0_; \
+        for (p_ = StackBottom(); (p_ < sp_) && (*p_ == STACK_PAINT); p_++) \
+            ; \
+        (RESULT).stack = sp_ - p_; \
+        if (p_ < sram_lowest) \
+            sram_lowest = p_; \
+    } while (0)
+
+// friend of AmigaHID; sets up state and reaches the private/protected hot paths
+class HotPathProbe
+{
+    public:
+        // put the parser in the state it would be in after receiving report (8 byte boot report)
+        static void Reset(AmigaHID *hid, const uint8_t *report)
+        {
+            static uint8_t old_buf[HID_BUF_MAX];
+
+            memcpy(old_buf, report, 8);
+            hid->old_buf = old_buf;
+            hid->old_buf_len = 8;
+            hid->caps_lock = false;
+            hid->num_nonboot = 0;
+            hid->routes.Clear();
+            hid->send_log = sent;
+            hid->send_log_max = sizeof(sent);
+            hid->send_count = 0;
+            hid->led_log = &leds;
+            leds = 0xff; // nothing written yet
+        }
+
+        // pretend a non-boot interface on ep was attached with this report descriptor
+        static void Attach(AmigaHID *hid, uint8_t ep, const uint8_t *descriptor, uint16_t len)
+        {
+            hid->nonboot[hid->num_nonboot].iface = hid->num_nonboot + 1;
+            hid->nonboot[hid->num_nonboot].ep = ep;
+            hid->num_nonboot++;
+            hid->routes.Begin(ep);
+            hid->routes.Parse(len, descriptor, 0);
+        }
+
+        static void Parse(AmigaHID *hid, uint8_t ep, uint8_t len, uint8_t *buf)
+        {
+            hid->ParseHIDData(hid, ep, false, len, buf);
+        }
+
+        // SendAmiga for real, on the bus
+        static void Unstub(AmigaHID *hid)
+        {
+            hid->send_log = NULL;
+        }
+
+        static void Send(AmigaHID *hid, uint8_t keycode)
+        {
+            hid->SendAmiga(keycode);
+        }
+
+        static uint8_t Sent(AmigaHID *hid)
+        {
+            return hid->send_count;
+        }
+
+        // translate the six key slots of a boot report with the firmware's own TranslateKey
+        static void __attribute__((noinline)) Translate(AmigaHID *hid, const uint8_t *report, uint8_t *out)
+        {
+            for (uint8_t i = 2; i < 8; i++)
+                out[i] = hid->TranslateKey(report[i]);
+        }
+};
+
+// report the measurement and fail if it's over budget
+static void CheckBudget(const char *name, Measurement m, uint32_t cycle_budget, uint16_t stack_budget)
+{
+    char msg[96];
+    uint32_t cycles = m.cycles - cycles_overhead;
+
+    snprintf(msg, sizeof(msg), "%s: %lu cycles (budget %lu), %u stack bytes (budget %u)",
+        name, cycles, cycle_budget, m.stack, stack_budget);
+    TEST_MESSAGE(msg);
+
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(cycle_budget, cycles, msg);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT16_MESSAGE(stack_budget, m.stack, msg);
+}
+
+static const uint8_t report_empty[8]   = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t report_a[8]       = { 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t report_a_to_f[8]  = { 0x00, 0x00, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
+static const uint8_t report_g_to_l[8]  = { 0xff, 0x00, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+// consumer control, report id 2, one 16-bit usage (as sent by most multimedia keyboards)
+static const uint8_t descriptor_consumer[] = {
+    0x05, 0x0c,         // usage page (consumer)
+    0x09, 0x01,         // usage (consumer control)
+    0xa1, 0x01,         // collection (application)
+    0x85, 0x02,         //   report id (2)
+    0x19, 0x00,         //   usage minimum (0)
+    0x2a, 0x3c, 0x02,   //   usage maximum (0x023c)
+    0x15, 0x00,         //   logical minimum (0)
+    0x26, 0x3c, 0x02,   //   logical maximum (0x023c)
+    0x95, 0x01,         //   report count (1)
+    0x75, 0x10,         //   report size (16)
+    0x81, 0x00,         //   input (data, array)
+    0xc0                // end collection
+};
+
+void test_isr()
+{
+    Measurement m;
+
+    MEASURE(m, TIMER1_COMPA_vect());
+    CheckBudget("TIMER1_COMPA_vect", m, BUDGET_CYCLES_ISR, BUDGET_STACK_ISR);
+}
+
+void test_keymap()
+{
+    Measurement m;
+    uint8_t out[8];
+
+    MEASURE(m, HotPathProbe::Translate(&amigaHid, report_a_to_f, out));
+    CheckBudget("keymap translate", m, BUDGET_CYCLES_KEYMAP, BUDGET_STACK_KEYMAP);
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_A, out[2]);
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_F, out[7]);
+}
+
+void test_send_amiga()
+{
+    Measurement m;
+
+    HotPathProbe::Unstub(&amigaHid);
+    MEASURE(m, HotPathProbe::Send(&amigaHid, AMIGA_A));
+    CheckBudget("SendAmiga", m, BUDGET_CYCLES_SENDAMIGA, BUDGET_STACK_SENDAMIGA);
+}
+
+void test_parse_idle()
+{
+    Measurement m;
+    uint8_t buf[8];
+
+    HotPathProbe::Reset(&amigaHid, report_a);
+    memcpy(buf, report_a, sizeof(buf));
+    MEASURE(m, HotPathProbe::Parse(&amigaHid, 1, sizeof(buf), buf));
+    CheckBudget("ParseHIDData idle", m, BUDGET_CYCLES_PARSE_IDLE, BUDGET_STACK_PARSE);
+    TEST_ASSERT_EQUAL_UINT8(0, HotPathProbe::Sent(&amigaHid));
+}
+
+void test_parse_keydown()
+{
+    Measurement m;
+    uint8_t buf[8];
+
+    HotPathProbe::Reset(&amigaHid, report_empty);
+    memcpy(buf, report_a, sizeof(buf));
+    MEASURE(m, HotPathProbe::Parse(&amigaHid, 1, sizeof(buf), buf));
+    CheckBudget("ParseHIDData keydown", m, BUDGET_CYCLES_PARSE_KEYDOWN, BUDGET_STACK_PARSE);
+    TEST_ASSERT_EQUAL_UINT8(1, HotPathProbe::Sent(&amigaHid));
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_A, sent[0]);
+}
+
+// a boot keyboard report still takes the fast path when a non-boot interface is attached alongside
+void test_parse_keydown_nonboot()
+{
+    Measurement m;
+    uint8_t buf[8];
+
+    HotPathProbe::Reset(&amigaHid, report_empty);
+    HotPathProbe::Attach(&amigaHid, 2, descriptor_consumer, sizeof(descriptor_consumer));
+    memcpy(buf, report_a, sizeof(buf));
+    MEASURE(m, HotPathProbe::Parse(&amigaHid, 1, sizeof(buf), buf));
+    CheckBudget("ParseHIDData keydown (non-boot attached)", m, BUDGET_CYCLES_PARSE_KEYDOWN_NONBOOT,
+        BUDGET_STACK_PARSE);
+    TEST_ASSERT_EQUAL_UINT8(1, HotPathProbe::Sent(&amigaHid));
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_A, sent[0]);
+}
+
+// caps lock goes down and the keyboard's caps lock led is turned on
+void test_parse_capslock()
+{
+    Measurement m;
+    uint8_t buf[8] = { 0x00, 0x00, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    HotPathProbe::Reset(&amigaHid, report_empty);
+    MEASURE(m, HotPathProbe::Parse(&amigaHid, 1, sizeof(buf), buf));
+    CheckBudget("ParseHIDData caps lock", m, BUDGET_CYCLES_PARSE_CAPSLOCK, BUDGET_STACK_PARSE);
+    TEST_ASSERT_EQUAL_UINT8(1, HotPathProbe::Sent(&amigaHid));
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_CAPSLOCK, sent[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x02, leds); // REP_CAPSLOCK
+}
+
+void test_parse_worst()
+{
+    Measurement m;
+    uint8_t buf[8];
+
+    // modifiers in the order ParseHIDData checks them, then a-f up, then g-l down
+    static const uint8_t expected[18] = {
+        AMIGA_LALT, AMIGA_RALT, AMIGA_LSHIFT, AMIGA_RSHIFT, AMIGA_LAMIGA, AMIGA_CTRL,
+        AMIGA_A | 0x80, AMIGA_B | 0x80, AMIGA_C | 0x80, AMIGA_D | 0x80, AMIGA_E | 0x80, AMIGA_F | 0x80,
+        AMIGA_G, AMIGA_H, AMIGA_I, AMIGA_J, AMIGA_K, AMIGA_L
+    };
+
+    HotPathProbe::Reset(&amigaHid, report_a_to_f);
+    memcpy(buf, report_g_to_l, sizeof(buf));
+    MEASURE(m, HotPathProbe::Parse(&amigaHid, 1, sizeof(buf), buf));
+    CheckBudget("ParseHIDData worst", m, BUDGET_CYCLES_PARSE_WORST, BUDGET_STACK_PARSE);
+    TEST_ASSERT_EQUAL_UINT8(sizeof(expected), HotPathProbe::Sent(&amigaHid));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, sent, sizeof(expected));
+}
+
+void test_parse_consumer()
+{
+    Measurement m;
+    uint8_t buf[3] = { 0x02, 0x23, 0x02 }; // report id 2, ac home
+
+    HotPathProbe::Reset(&amigaHid, report_empty);
+    HotPathProbe::Attach(&amigaHid, 2, descriptor_consumer, sizeof(descriptor_consumer));
+    MEASURE(m, HotPathProbe::Parse(&amigaHid, 2, sizeof(buf), buf));
+    CheckBudget("ParseHIDData consumer", m, BUDGET_CYCLES_PARSE_CONSUMER, BUDGET_STACK_PARSE);
+    TEST_ASSERT_EQUAL_UINT8(2, HotPathProbe::Sent(&amigaHid));
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_LAMIGA, sent[0]);
+    TEST_ASSERT_EQUAL_HEX8(AMIGA_N, sent[1]);
+}
+
+// must run last: uses the lowest address any of the above reached
+void test_sram_high_water()
+{
+    char msg[64];
+    uint16_t used;
+
+    used = ((uint16_t)StackBottom() - RAMSTART) + (RAMEND + 1 - (uint16_t)sram_lowest);
+    snprintf(msg, sizeof(msg), "sram high water: %u bytes (budget %u)", used, BUDGET_SRAM_HIGH_WATER);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT16_MESSAGE(BUDGET_SRAM_HIGH_WATER, used, msg);
+}
+
+void setup()
+{
+    Measurement m;
+
+    // TIMER5 free running at the cpu clock, stopped until MEASURE starts it
+    TCCR5A = 0;
+    TCCR5B = 0;
+    TIMSK5 = _BV(TOIE5);
+
+    // calibrate: whatever an empty measurement reads is overhead
+    MEASURE(m, (void)0);
+    cycles_overhead = m.cycles;
+
+    UNITY_BEGIN();
+    RUN_TEST(test_isr);
+    RUN_TEST(test_keymap);
+    RUN_TEST(test_send_amiga);
+    RUN_TEST(test_parse_idle);
+    RUN_TEST(test_parse_keydown);
+    RUN_TEST(test_parse_keydown_nonboot);
+    RUN_TEST(test_parse_capslock);
+    RUN_TEST(test_parse_worst);
+    RUN_TEST(test_parse_consumer);
+    RUN_TEST(test_sram_high_water);
+    UNITY_END();
+}
+
+void loop()
+{
+}